@@ -50,6 +50,55 @@
 
 #include "PJON_ASK.h"
 
+#if defined(LOW_POWER_LISTEN)
+  #include <avr/interrupt.h>
+  #include <avr/sleep.h>
+  #include <avr/wdt.h>
+
+  #if defined(WDTCR) && !defined(WDTCSR)
+    #define WDTCSR WDTCR
+  #endif
+
+  /* Timer0 counters of the Arduino core, used to keep millis() and micros()
+     in line with the time spent sleeping (timer0 is halted in power-down) */
+  extern volatile unsigned long timer0_millis;
+  extern volatile unsigned long timer0_overflow_count;
+
+  static volatile boolean watchdog_woke_up = false;
+
+  /* Add the microseconds slept to the timer0 counters, the remainders
+     shorter than a millisecond or a timer0 overflow are carried over */
+  static unsigned long sleep_millis_remainder = 0;
+  static unsigned long sleep_overflow_remainder = 0;
+
+  static void sleep_credit(unsigned long duration) {
+    const unsigned long overflow = 16384 / clockCyclesPerMicrosecond();
+    sleep_millis_remainder += duration;
+    sleep_overflow_remainder += duration;
+    noInterrupts();
+    timer0_millis += sleep_millis_remainder / 1000;
+    timer0_overflow_count += sleep_overflow_remainder / overflow;
+    interrupts();
+    sleep_millis_remainder %= 1000;
+    sleep_overflow_remainder %= overflow;
+  }
+
+  ISR(WDT_vect) {
+    watchdog_woke_up = true;
+  }
+
+  /* Pin change interrupts are used only to wake up the MCU */
+  #if defined(PCINT0_vect)
+    EMPTY_INTERRUPT(PCINT0_vect);
+  #endif
+  #if defined(PCINT1_vect)
+    EMPTY_INTERRUPT(PCINT1_vect);
+  #endif
+  #if defined(PCINT2_vect)
+    EMPTY_INTERRUPT(PCINT2_vect);
+  #endif
+#endif
+
 /* Initiate PJON passing pin number:
    Device's id has to be set through set_id()
    before transmitting on the PJON network.  */
@@ -72,6 +121,40 @@ PJON_ASK::PJON_ASK(uint8_t input_pin, uint8_t output_pin, uint8_t device_id) {
 void PJON_ASK::initialize(uint8_t input_pin, uint8_t output_pin) {
   _input_pin = input_pin;
   _output_pin = output_pin;
+  _preamble = 0;
+  _ack_next = 0;
+
+#if defined(INCLUDE_TDMA)
+  _tdma = 0;
+  _slot = NO_SLOT;
+  _slots = 0;
+  _beacon_time = 0;
+  _drift = 0;
+#endif
+
+#if defined(INCLUDE_ROUTING)
+  _route_count = 0;
+#endif
+
+  for(uint8_t i = 0; i < ACK_PEERS; i++)
+    _ack_peers[i].delay = 0;
+
+#if defined(PAYLOAD_CODEC)
+  _codec = false;
+  _codec_evict = 0;
+  for(uint8_t i = 0; i < CODEC_PEERS; i++)
+    _peers[i].flags = 0;
+#endif
+
+#if defined(ENCRYPTION)
+  _encryption = false;
+  _nonce = 0;
+  _nonce_seeded = false;
+  _replay_next = 0;
+  for(uint8_t i = 0; i < REPLAY_PEERS; i++)
+    _replay[i].counter = 0;
+  _crypto_pending = false;
+#endif
 
   if(input_pin == NOT_USED || output_pin == NOT_USED)
     _simplex = true;
@@ -83,6 +166,9 @@ void PJON_ASK::initialize(uint8_t input_pin, uint8_t output_pin) {
     packets[i].state = NULL;
     packets[i].timing = 0;
     packets[i].attempts = 0;
+#if defined(INCLUDE_ROUTING)
+    packets[i].ttl = 0;
+#endif
   }
 }
 
@@ -132,6 +218,59 @@ void PJON_ASK::set_error(error e) {
 }
 
 
+/* Set the duration in microseconds of the carrier transmitted before every
+   packet. Used to wake up devices sleeping in listen(), should be at least
+   WAKE_UP_PREAMBLE. Has to be set also on the receiver side, where it is used
+   as the maximum accepted carrier duration. 0 (default) disables it. */
+
+void PJON_ASK::set_preamble(unsigned long duration) {
+  _preamble = duration;
+}
+
+
+#if defined(INCLUDE_TDMA)
+
+/* Enable or disable the time slotted (TDMA) mode as a node:
+   Packets are sent only in the slot assigned to the device by the last
+   beacon received from the master, until synchronized nothing is sent. */
+
+void PJON_ASK::set_tdma(boolean state) {
+  _tdma = state ? TDMA_NODE : 0;
+  _slot = NO_SLOT;
+  _beacon_time = 0;
+  _drift = 0;
+}
+
+
+/* Enable the time slotted (TDMA) mode as master, passing the slot map,
+   an array containing the device id assigned to each slot, its length and
+   the duration of a slot in milliseconds. A slot should be long enough to
+   contain the longest packet sent and its acknowledge plus guard times.
+   The master broadcasts the slot map in update() every cycle.
+
+  uint8_t slot_map[] = {44, 45, 46};
+  network.set_tdma_master(slot_map, 3, 100); */
+
+void PJON_ASK::set_tdma_master(uint8_t *slot_map, uint8_t slots, unsigned int slot_duration) {
+  if(slots > MAX_SLOTS) slots = MAX_SLOTS;
+
+  _tdma = TDMA_MASTER;
+  _slots = slots;
+  _slot_duration = slot_duration;
+  _slot = NO_SLOT;
+  _beacon_time = 0;
+  _drift = 0;
+
+  for(uint8_t i = 0; i < slots; i++) {
+    _slot_map[i] = slot_map[i];
+    if(slot_map[i] == _device_id)
+      _slot = i;
+  }
+}
+
+#endif
+
+
 /* Check if the channel if free for transmission:
  If an entire byte received contains no 1s it means
  that there is no active transmission */
@@ -187,6 +326,38 @@ void PJON_ASK::send_byte(uint8_t b) {
 }
 
 
+/* Send the response to a packet received:
+ With COMPACT_ACK a single pulse is transmitted instead of the ACK or NAK
+ byte, optionally followed by a BIT_WIDTH pause and a check bit.
+  __________________ ______________________
+ | ACK              | Check bit (optional) |
+ |_______________   |          ___         |
+ |               |  |         |   |        |
+ | 1 (ACK_PULSE) |0 |    0    | 1 |        |
+ |_______________|__|_________|___|________| */
+
+void PJON_ASK::send_response(uint8_t response, uint8_t check) {
+  pinModeFast(_output_pin, OUTPUT);
+#if defined(COMPACT_ACK)
+  digitalWriteFast(_output_pin, HIGH);
+  delayMicroseconds(response == ACK ? ACK_PULSE : NAK_PULSE);
+  digitalWriteFast(_output_pin, LOW);
+  #if defined(ACK_CHECK_BIT)
+    delayMicroseconds(BIT_WIDTH);
+    digitalWriteFast(_output_pin, check);
+    delayMicroseconds(BIT_WIDTH);
+    digitalWriteFast(_output_pin, LOW);
+  #else
+    (void)check;
+  #endif
+#else
+  (void)check;
+  this->send_byte(response);
+  digitalWriteFast(_input_pin, LOW);
+#endif
+}
+
+
 /* An Example of how the string "@" is formatted and sent:
 
  ID 12            LENGTH 4         CONTENT 64       CRC 130
@@ -197,6 +368,31 @@ void PJON_ASK::send_byte(uint8_t b) {
 | 1 |0|0000|11|00| 1 |0|00000|1|00| 1 |0|0|1|000000| 1 |0|0|1|0000|1|0|
 |___|_|____|__|__|___|_|_____|_|__|___|_|_|_|______|___|_|_|_|____|_|_|
 
+If a preamble is set with set_preamble(), the packet is preceded by a
+carrier of the configured duration. It is not followed by a pause but
+continues in the synchronization pad of the first byte, so its end can't
+be mistaken for a pad by a receiver that is already listening:
+ __________________ _____________
+|Preamble          |ID ...       |
+|__________________|___          |
+|                      |         |
+|     HIGH         | 1 |0 ...    |
+|__________________|___|_________|
+
+A routed packet (sent to a device reachable through one or more routers)
+has the ROUTED bit of LENGTH set and carries after it the id of the final
+destination and the remaining hops, the ID is the one of the next router:
+ _______ ________________ ________________ _______ _________ _____
+| ID 10 | LENGTH 128 + 6 | DESTINATION 50 | TTL 8 | CONTENT | CRC |
+|_______|________________|________________|_______|_________|_____|
+
+If ENCRYPTION is included and a key is set, LENGTH is followed by the nonce
+(sender id and frame counter), the bytes after it are encrypted and the CRC
+is replaced by the MAC (MAC_LENGTH bytes) of all the preceding ones:
+ _______ __________ ______ _____________ _____________________ _____
+| ID 12 | LENGTH 8 | ID 5 | COUNTER 24b | CONTENT (encrypted) | MAC |
+|_______|__________|______|_____________|_____________________|_____|
+
 A standard packet transmission is a bidirectional communication between
 two devices that can be divided in 3 different phases:
 
@@ -207,39 +403,132 @@ Channel analysis   Transmission                            Response
    |  0  |         | 12 |   4    |   64    | 130 |         |  6  |
    |_____|         |____|________|_________|_____|         |_____|  */
 
-int PJON_ASK::send_string(uint8_t ID, char *string, uint8_t length) {
+int PJON_ASK::send_string(uint8_t ID, char *string, uint8_t length, uint8_t destination, uint8_t ttl) {
   if (!*string) return FAIL;
 
+#if !defined(INCLUDE_ROUTING)
+  (void)destination;
+  (void)ttl;
+#endif
+
+  uint8_t flags = 0;
+
+  /* The whole frame is composed (and encrypted) before transmission
+     so that nothing is computed between send_byte() calls */
+  uint8_t frame[PACKET_MAX_LENGTH];
+  uint8_t header = 2;
+  uint8_t trailer = 1;
+
+#if defined(ENCRYPTION)
+  if(!this->nonce_available(ID)) return FAIL;
+  if(_encryption) {
+    header += NONCE_LENGTH;
+    trailer = MAC_LENGTH;
+  }
+#endif
+
+#if defined(INCLUDE_ROUTING)
+  if(ttl) {
+    frame[header] = destination;
+    frame[header + 1] = ttl;
+    header += 2;
+    flags |= ROUTED;
+  }
+#endif
+
+#if defined(PAYLOAD_CODEC)
+  /* If the encoded payload (i.e. a key frame) does not fit, it is sent raw */
+  char *payload = string;
+  uint8_t payload_length = length;
+  uint8_t encoded[PACKET_MAX_LENGTH + 2];
+  if(_codec && !ttl) {
+    int encoded_length = this->encode(ID, (uint8_t *)string, length, encoded);
+    if(encoded_length != FAIL && header + encoded_length + trailer < PACKET_MAX_LENGTH) {
+      string = (char *)encoded;
+      length = encoded_length;
+      flags |= ENCODED;
+    }
+  }
+#endif
+
+  uint8_t total = header + length + trailer;
+  if(total >= PACKET_MAX_LENGTH) return FAIL;
+
+  frame[0] = ID;
+  frame[1] = total | flags;
+  memcpy(frame + header, string, length);
+
+#if defined(ENCRYPTION)
+  if(_encryption) {
+    /* 24 bits frame counter and device id */
+    _nonce++;
+    frame[2] = _device_id;
+    frame[3] = _nonce >> 16;
+    frame[4] = _nonce >> 8;
+    frame[5] = _nonce;
+    this->crypto_begin(frame, total);
+    while(this->crypto_step());
+    this->crypto_xor();
+    this->crypto_end(false);
+  } else
+#endif
+  {
+    frame[total - 1] = 0;
+    for(uint8_t i = 0; i < total - 1; i++)
+      frame[total - 1] ^= frame[i];
+  }
+
+#if defined(INCLUDE_TDMA)
+  /* In TDMA mode the channel is reserved, carrier sense is not necessary */
+  if(!_simplex && !_tdma)
+#else
   if(!_simplex)
+#endif
     if(!this->can_start()) return BUSY;
 
-  uint8_t CRC = 0;
   pinModeFast(_output_pin, OUTPUT);
 
-  this->send_byte(ID);
-  CRC ^= ID;
-  this->send_byte(length + 3);
-  CRC ^= length + 3;
-
-  for(uint8_t i = 0; i < length; i++) {
-    this->send_byte(string[i]);
-    CRC ^= string[i];
+  /* The preamble continues in the synchronization pad of the first byte */
+  if(_preamble) {
+    unsigned long time = micros();
+    digitalWriteFast(_output_pin, HIGH);
+    /* (freak condition used to avoid micros() overflow bug) */
+    while(!(micros() - time >= _preamble));
   }
 
-  this->send_byte(CRC);
+  for(uint8_t i = 0; i < total; i++)
+    this->send_byte(frame[i]);
+
   digitalWriteFast(_output_pin, LOW);
 
   if(ID == BROADCAST || _simplex) return ACK;
 
   unsigned long time = micros();
+  unsigned long timeout = this->ack_timeout(ID);
+  unsigned long delay = 0;
   int response = FAIL;
 
-  /* Receive byte for an initial BIT_SPACER bit + standard bit total duration.
+  /* Receive the response for an initial BIT_SPACER bit + standard bit total
+     duration or for the delay measured for this device (see ack_timeout).
      (freak condition used to avoid micros() overflow bug) */
-  while(response == FAIL && !(micros() - time >= BIT_SPACER + BIT_WIDTH))
+  while(response == FAIL && !(micros() - time >= timeout)) {
+    delay = micros() - time;
+#if defined(COMPACT_ACK)
+    response = this->receive_response(frame[total - 1] & 1);
+#else
     response = this->receive_byte();
+#endif
+  }
 
-  if (response == ACK || response == NAK) return response;
+  this->ack_measure(ID, response, delay);
+
+  if (response == ACK || response == NAK) {
+#if defined(PAYLOAD_CODEC)
+    if(flags & ENCODED)
+      this->codec_commit(ID, (uint8_t *)payload, payload_length, encoded[0], response);
+#endif
+    return response;
+  }
 
   return FAIL;
 };
@@ -250,17 +539,54 @@ int PJON_ASK::send_string(uint8_t ID, char *string, uint8_t length) {
  Using the timing parameter you can set the delay between every
  transmission cyclically sending the packet (use remove() function stop it)
 
+ If a route to the device is present in the routing table the packet is
+ routed (see add_route), in a router it is inserted in the send list of the
+ bus leading to the device.
+
  int hi = network.send(99, "HI!", 3, 1000000); // Send hi every second
-   _________________________________________________________________________
-  |           |        |         |       |          |        |              |
-  | device_id | length | content | state | attempts | timing | registration |
-  |___________|________|_________|_______|__________|________|______________| */
+   _______________________________________________________________________________________________
+  |           |             |     |        |         |       |          |        |              |
+  | device_id | destination | ttl | length | content | state | attempts | timing | registration |
+  |___________|_____________|_____|________|_________|_______|__________|________|______________| */
 
 int PJON_ASK::send(uint8_t ID, char *packet, uint8_t length, unsigned long timing) {
-  if(length >= PACKET_MAX_LENGTH) {
+#if defined(INCLUDE_ROUTING)
+  for(uint8_t i = 0; i < _route_count; i++)
+    if(_routes[i].destination == ID) {
+      PJON_ASK *bus = _routes[i].bus ? _routes[i].bus : this;
+      if(_routes[i].via == ID)
+        return bus->dispatch(ID, 0, 0, packet, length, timing);
+      return bus->dispatch(_routes[i].via, ID, MAX_HOPS, packet, length, timing);
+    }
+#endif
+
+  return this->dispatch(ID, 0, 0, packet, length, timing);
+}
+
+
+/* Insert a packet in the send list passing the id of the device it is
+   transmitted to and, if routed, the id of its final destination and
+   the hops it can still do (0 if directly sent to its destination): */
+
+int PJON_ASK::dispatch(uint8_t ID, uint8_t destination, uint8_t ttl, char *packet, uint8_t length, unsigned long timing) {
+#if !defined(INCLUDE_ROUTING)
+  (void)destination;
+#endif
+
+  if(length + (ttl ? 5 : 3) + CRYPTO_OVERHEAD >= PACKET_MAX_LENGTH) {
     this->_error(CONTENT_TOO_LONG, length);
     return FAIL;
   }
+
+  /* Timing is stored in packet_time units, a longer one can't be represented */
+  if(timing > PACKET_MICROS((packet_time)~0)) {
+    this->_error(TIMING_TOO_LONG, ID);
+    return FAIL;
+  }
+
+#if defined(ENCRYPTION)
+  if(!this->nonce_available(ID)) return FAIL;
+#endif
   
   char *str = (char *) malloc(length);
 
@@ -275,15 +601,20 @@ int PJON_ASK::send(uint8_t ID, char *packet, uint8_t length, unsigned long timin
     if(packets[i].state == NULL) {
       packets[i].content = str;
       packets[i].device_id = ID;
+#if defined(INCLUDE_ROUTING)
+      packets[i].destination = destination;
+      packets[i].ttl = ttl;
+#endif
       packets[i].length = length;
       packets[i].state = TO_BE_SENT;
-      if(timing > 0) {
-        packets[i].registration = micros();
-        packets[i].timing = timing;
-      }
+      packets[i].registration = PACKET_TIME(micros());
+      /* Rounded up, a repeated packet shorter than a unit does not become
+         a one-shot one (timing 0) */
+      packets[i].timing = PACKET_TIME(timing + PACKET_MICROS(1) - 1);
       return i;
     }
 
+  free(str);
   this->_error(PACKETS_BUFFER_FULL, MAX_PACKETS);
   return FAIL;
 }
@@ -294,35 +625,144 @@ int PJON_ASK::send(uint8_t ID, char *packet, uint8_t length, unsigned long timin
    the correctly delivered */
 
 void PJON_ASK::update() {
-  for(uint8_t i = 0; i < MAX_PACKETS; i++) {
-    if(packets[i].state != NULL)
-      if(micros() - packets[i].registration > packets[i].timing + pow(packets[i].attempts, 2))
-        packets[i].state = send_string(packets[i].device_id, packets[i].content, packets[i].length);
+#if defined(INCLUDE_TDMA)
+  if(_tdma == TDMA_MASTER)
+    if(!_beacon_time || micros() - _beacon_time >= (unsigned long)_slot_duration * 1000 * _slots)
+      this->send_beacon();
+#endif
 
-    if(packets[i].state == ACK) {
+  for(uint8_t i = 0; i < MAX_PACKETS; i++) {
+    if(packets[i].state == NULL || this->packet_due(i)) continue;
+
+#if defined(INCLUDE_TDMA)
+    /* A synchronized device missing from the slot map can never send */
+    if(_tdma && _beacon_time && _slot == NO_SLOT) {
+      this->_error(SLOT_NOT_ASSIGNED, packets[i].device_id);
+      this->remove(i);
+      continue;
+    }
+    /* 2 bytes of margin for the routing or codec header */
+    if(!this->slot_fits(packets[i].length + 2)) {
+      this->_error(CONTENT_TOO_LONG, packets[i].length);
+      this->remove(i);
+      continue;
+    }
+    if(this->slot_wait(packets[i].length + 2)) continue;
+#endif
+
+    int response = send_string(
+      packets[i].device_id,
+      packets[i].content,
+      packets[i].length
+#if defined(INCLUDE_ROUTING)
+      , packets[i].destination,
+      packets[i].ttl
+#endif
+    );
+
+    if(response == ACK) {
       if(!packets[i].timing)
         this->remove(i);
       else {
         packets[i].attempts = 0;
-        packets[i].registration = micros();
+        packets[i].registration = PACKET_TIME(micros());
         packets[i].state = TO_BE_SENT;
       }
-    }
-    if(packets[i].state == FAIL) {
+    } else if(response == FAIL || response == NAK) {
       packets[i].attempts++;
 
+      /* NAK (i.e. a router with the send list full) is counted as a failed
+         attempt and the backoff (see packet_due) is waited from the NAK,
+         not from the registration, so that the channel is not saturated */
+      if(response == NAK)
+        packets[i].registration = PACKET_TIME(micros()) - packets[i].timing;
+
       if(packets[i].attempts > MAX_ATTEMPTS) {
         this->_error(CONNECTION_LOST, packets[i].device_id);
+#if defined(PAYLOAD_CODEC)
+        this->codec_reset(packets[i].device_id);
+#endif
         if(!packets[i].timing)
           this->remove(i);
         else {
           packets[i].attempts = 0;
-          packets[i].registration = micros();
+          packets[i].registration = PACKET_TIME(micros());
           packets[i].state = TO_BE_SENT;
         }
-      }
+      } else packets[i].state = (response == NAK) ? NAK : TO_BE_SENT;
+    } else packets[i].state = TO_BE_SENT;
+  }
+}
+
+
+/* Microseconds until a packet of the send list is due, 0 if it has to be
+   sent now. After a failure it waits also a frame duration (acknowledge
+   included) for each attempt, up to MAX_BACKOFF frames. */
+
+unsigned long PJON_ASK::packet_due(uint8_t id) {
+  uint8_t backoff = packets[id].attempts;
+  if(backoff > MAX_BACKOFF) backoff = MAX_BACKOFF;
+
+  packet_time since = PACKET_TIME(micros()) - packets[id].registration;
+  unsigned long elapsed = PACKET_MICROS(since);
+  unsigned long target = PACKET_MICROS(packets[id].timing) +
+    (unsigned long)backoff * (packets[id].length + 4) * BYTE_DURATION;
+
+  if(elapsed >= target) return 0;
+  return target - elapsed;
+}
+
+
+/* Time waited for the response of a device after transmitting a packet:
+   ACK_TIMEOUT if its response delay is unknown, otherwise twice the delay
+   measured plus ACK_MARGIN (never longer than ACK_TIMEOUT). A fast response
+   can be followed by a slower one (i.e. a packet to be decoded or forwarded),
+   so at least ACK_PROCESSING plus ACK_MARGIN is waited. */
+
+unsigned long PJON_ASK::ack_timeout(uint8_t ID) {
+  for(uint8_t i = 0; i < ACK_PEERS; i++)
+    if(_ack_peers[i].delay && _ack_peers[i].device_id == ID) {
+      unsigned long timeout = (unsigned long)_ack_peers[i].delay * 2 + ACK_MARGIN;
+      if(timeout < ACK_PROCESSING + ACK_MARGIN) timeout = ACK_PROCESSING + ACK_MARGIN;
+      return timeout < ACK_TIMEOUT ? timeout : ACK_TIMEOUT;
     }
+
+  return ACK_TIMEOUT;
+}
+
+
+/* Save the response delay measured for a device, if it did not respond
+   the delay is forgotten so that the next response is waited ACK_TIMEOUT. */
+
+void PJON_ASK::ack_measure(uint8_t ID, int response, unsigned long delay) {
+  ack_peer *peer = NULL;
+  for(uint8_t i = 0; i < ACK_PEERS; i++)
+    if(_ack_peers[i].delay && _ack_peers[i].device_id == ID)
+      peer = &_ack_peers[i];
+
+  if(response != ACK && response != NAK) {
+    if(peer != NULL) peer->delay = 0;
+    return;
   }
+
+  /* 0 is used to mark a free slot */
+  if(!delay) delay = 1;
+
+  if(peer == NULL) {
+    for(uint8_t i = 0; i < ACK_PEERS && peer == NULL; i++)
+      if(!_ack_peers[i].delay)
+        peer = &_ack_peers[i];
+
+    if(peer == NULL)
+      peer = &_ack_peers[_ack_next++ % ACK_PEERS];
+
+    peer->device_id = ID;
+    peer->delay = delay;
+    return;
+  }
+
+  /* A longer delay is adopted immediately, a shorter one averaged */
+  peer->delay = delay > peer->delay ? delay : (peer->delay + delay) / 2;
 }
 
 
@@ -332,11 +772,211 @@ void PJON_ASK::remove(int id) {
   free(packets[id].content);
   packets[id].attempts = 0;
   packets[id].device_id = NULL;
+#if defined(INCLUDE_ROUTING)
+  packets[id].ttl = 0;
+#endif
   packets[id].length = NULL;
   packets[id].state = NULL;
   packets[id].registration = NULL;
+  packets[id].timing = 0;
+}
+
+#if defined(INCLUDE_ROUTING)
+
+/* Add a route to the routing table, passing the id of the destination,
+ the id of the device the packets are transmitted to (the destination
+ itself if directly reachable) and, in a router connected to more buses
+ (one PJON_ASK instance per radio channel), the bus leading to it.
+ Returns the index of the route or FAIL if the table is full.
+
+  // Node: reach device 50 through the router 10
+  network.add_route(50, 10);
+
+  // Router: frames for 50 received on bus_a are sent directly to 50 on bus_b
+  bus_a.add_route(50, 50, &bus_b); */
+
+int PJON_ASK::add_route(uint8_t destination, uint8_t via, PJON_ASK *bus) {
+  if(bus == this) bus = NULL;
+
+  for(uint8_t i = 0; i < _route_count; i++)
+    if(_routes[i].destination == destination) {
+      _routes[i].via = via;
+      _routes[i].bus = bus;
+      return i;
+    }
+
+  if(_route_count >= MAX_ROUTES) return FAIL;
+
+  _routes[_route_count].destination = destination;
+  _routes[_route_count].via = via;
+  _routes[_route_count].bus = bus;
+  return _route_count++;
+}
+
+
+/* Forward a routed packet received toward its destination:
+ The packet is inserted in the send list of the bus leading to it, sent
+ directly if the destination is reachable or routed with one hop less.
+ Returns NAK if the send list has no room (FORWARD_RESERVED slots are
+ kept for local packets) so the sender will retry, ACK otherwise.
+ Packets with no route or hops left are dropped notifying an error. */
+
+int PJON_ASK::forward(uint8_t destination, uint8_t ttl, char *packet, uint8_t length) {
+  route *r = NULL;
+  for(uint8_t i = 0; i < _route_count; i++)
+    if(_routes[i].destination == destination)
+      r = &_routes[i];
+
+  if(r == NULL) {
+    this->_error(ROUTE_NOT_FOUND, destination);
+    return ACK;
+  }
+
+  if(r->via != destination && ttl <= 1) {
+    this->_error(HOPS_EXCEEDED, destination);
+    return ACK;
+  }
+
+  PJON_ASK *bus = r->bus ? r->bus : this;
+  uint8_t free_slots = 0;
+  for(uint8_t i = 0; i < MAX_PACKETS; i++)
+    if(bus->packets[i].state == NULL)
+      free_slots++;
+
+  if(free_slots <= FORWARD_RESERVED) return NAK;
+
+  if(r->via == destination)
+    return bus->dispatch(destination, 0, 0, packet, length, 0) == FAIL ? NAK : ACK;
+
+  return bus->dispatch(r->via, destination, ttl - 1, packet, length, 0) == FAIL ? NAK : ACK;
+}
+
+#endif
+
+#if defined(INCLUDE_TDMA)
+
+/* Broadcast the TDMA beacon containing the slot duration and slot map:
+   Slots start when the beacon ends, the next beacon follows the last slot.
+   __________________________________ __________________________________
+  |Beacon                            | Slot 0 | Slot 1 | Slot 2 | Beacon |
+  |__________________________________|________|________|________|________|
+  | ID 124 | LENGTH | 254 | DURATION | SLOT MAP | CRC  |        |
+  |________|________|_____|__________|__________|______| */
+
+void PJON_ASK::send_beacon() {
+  char beacon[MAX_SLOTS + 3];
+  beacon[0] = TDMA_BEACON;
+  beacon[1] = _slot_duration >> 8;
+  beacon[2] = _slot_duration & 0xFF;
+  memcpy(beacon + 3, _slot_map, _slots);
+
+  if(this->send_string(BROADCAST, beacon, _slots + 3) == ACK)
+    _beacon_time = micros();
+}
+
+
+/* Synchronize to the beacon just received:
+   The slot of the device is searched in the slot map and the drift is
+   measured comparing the time passed since the previous beacon with the
+   expected cycle duration. The drift is added to the guard times. */
+
+void PJON_ASK::synchronize() {
+  unsigned long time = micros();
+  _slot_duration = data[3] << 8 | data[4];
+  _slots = data[1] - 6;
+  if(_slots > MAX_SLOTS) _slots = MAX_SLOTS;
+
+  _slot = NO_SLOT;
+  for(uint8_t i = 0; i < _slots; i++)
+    if(data[5 + i] == _device_id)
+      _slot = i;
+
+  if(_beacon_time) {
+    unsigned long interval = time - _beacon_time;
+    unsigned long cycle = this->cycle_duration();
+    /* Measure only consecutive beacons */
+    if(interval < cycle + cycle / 2) {
+      _drift = (_drift + (interval > cycle ? interval - cycle : cycle - interval)) / 2;
+      if(_drift > (unsigned long)_slot_duration * 250)
+        _drift = (unsigned long)_slot_duration * 250;
+    }
+  }
+  _beacon_time = time;
+}
+
+
+/* Duration of a TDMA cycle (slots and beacon) in microseconds */
+
+unsigned long PJON_ASK::cycle_duration() {
+  uint8_t overhead = 0;
+#if defined(ENCRYPTION)
+  if(_encryption) overhead = CRYPTO_OVERHEAD;
+#endif
+  return (unsigned long)_slot_duration * 1000 * _slots +
+         (unsigned long)(_slots + 6 + overhead) * BYTE_DURATION +
+         _preamble;
+}
+
+
+/* Microseconds needed to send a packet of the length passed in a slot,
+   acknowledge (waited up to ACK_TIMEOUT) included. With encryption the
+   keystream is computed before transmission: being every crypto_step()
+   shorter than BIT_WIDTH, a block lasts at most 32 / XTEA_STEP of them. */
+
+unsigned long PJON_ASK::slot_airtime(uint8_t length) {
+  unsigned long precompute = 0;
+#if defined(ENCRYPTION)
+  if(_encryption) {
+    length += CRYPTO_OVERHEAD;
+    precompute = (unsigned long)((length - 2 - NONCE_LENGTH + 7) / 8) *
+                 (32 / XTEA_STEP) * BIT_WIDTH;
+  }
+#endif
+  return precompute + (unsigned long)(length + 4) * BYTE_DURATION +
+         ACK_TIMEOUT + _preamble;
+}
+
+
+/* Check if a packet of the length passed can ever fit in the slot of the
+ device with its guard times (without drift, that can decrease), true if
+ TDMA is not active or the device is not synchronized yet. */
+
+boolean PJON_ASK::slot_fits(uint8_t length) {
+  if(!_tdma || _slot == NO_SLOT || !_beacon_time) return true;
+  return this->slot_airtime(length) + 2 * BIT_WIDTH <=
+         (unsigned long)_slot_duration * 1000;
+}
+
+
+/* Microseconds until a packet of the length passed can be sent:
+ 0 if TDMA is not active or the transmission, acknowledge included, fits
+ in the slot of the device now, 0xFFFFFFFF if the device has no slot or
+ is not synchronized. A guard time of BIT_WIDTH plus the measured drift
+ is left at the beginning and at the end of the slot. */
+
+unsigned long PJON_ASK::slot_wait(uint8_t length) {
+  if(!_tdma) return 0;
+  if(_slot == NO_SLOT || !_beacon_time) return 0xFFFFFFFF;
+
+  unsigned long cycle = this->cycle_duration();
+  unsigned long elapsed = micros() - _beacon_time;
+  if(elapsed > cycle * TDMA_MAX_MISSED) return 0xFFFFFFFF;
+
+  elapsed %= cycle;
+  unsigned long guard = BIT_WIDTH + _drift;
+  unsigned long start = (unsigned long)_slot_duration * 1000 * _slot + guard;
+  unsigned long end = (unsigned long)_slot_duration * 1000 * (_slot + 1) - guard;
+  unsigned long duration = this->slot_airtime(length);
+
+  if(start + duration > end) return 0xFFFFFFFF;
+  if(elapsed < start) return start - elapsed;
+  if(elapsed + duration <= end) return 0;
+  return cycle - elapsed + start;
 }
 
+#endif
+
+
 /* Check if a byte is coming from the pin:
  This function is looking for padding bits before a byte.
  If value is 1 for more than ACCEPTANCE and after
@@ -356,8 +996,10 @@ int PJON_ASK::receive_byte() {
   unsigned long time = micros();
 
   /* Update pin value until the pin stops to be HIGH or passed more time than
-     BIT_SPACER duration (freak condition used to avoid micros() overflow bug) */
-  while(!(micros() - time > BIT_SPACER) && digitalReadFast(_input_pin))
+     BIT_SPACER duration, plus the preamble duration if set, so that the pad
+     following a preamble is synchronized on its end
+     (freak condition used to avoid micros() overflow bug) */
+  while(!(micros() - time > BIT_SPACER + _preamble) && digitalReadFast(_input_pin))
     value = (value * 0.999)  + (digitalReadFast(_input_pin) * 0.001);
 
   /* Save how much time passed */
@@ -369,6 +1011,12 @@ int PJON_ASK::receive_byte() {
   if(value > 0.5) {
     value = 0.5;
 
+#if defined(ENCRYPTION)
+    /* A keystream step is computed at the beginning of the start bit,
+       the remaining part of it is enough to validate it */
+    if(_crypto_pending) this->crypto_step();
+#endif
+
     /* (freak condition used to avoid micros() overflow bug) */
     while(!(micros() - time > BIT_WIDTH))
       value = (value * 0.999)  + (digitalReadFast(_input_pin) * 0.001);
@@ -379,6 +1027,38 @@ int PJON_ASK::receive_byte() {
 }
 
 
+/* Receive a compact response from the pin:
+ The length of the pulse tells ACK from NAK. If ACK_CHECK_BIT is defined the
+ check bit has to be equal to the one passed (lowest bit of the CRC sent). */
+
+int PJON_ASK::receive_response(uint8_t check) {
+  unsigned long time = micros();
+  /* (freak condition used to avoid micros() overflow bug) */
+  while(digitalReadFast(_input_pin) && !(micros() - time > ACK_PULSE + BIT_WIDTH));
+
+  unsigned long width = micros() - time;
+  if(width < NAK_PULSE / 2 || width > ACK_PULSE + BIT_WIDTH) return FAIL;
+
+  int response = (width > (ACK_PULSE + NAK_PULSE) / 2) ? ACK : NAK;
+
+#if defined(ACK_CHECK_BIT)
+  time = micros();
+  while(!(micros() - time > BIT_WIDTH));
+
+  time = micros();
+  float value = 0.5;
+  while(!(micros() - time > BIT_WIDTH))
+    value = ((value * 0.999) + (digitalReadFast(_input_pin) * 0.001));
+
+  if((value > 0.5) != check) return FAIL;
+#else
+  (void)check;
+#endif
+
+  return response;
+}
+
+
 /* Read a byte from the pin */
 
 uint8_t PJON_ASK::read_byte() {
@@ -404,6 +1084,10 @@ int PJON_ASK::receive() {
   int package_length = PACKET_MAX_LENGTH;
   uint8_t CRC = 0;
 
+#if defined(ENCRYPTION)
+  _crypto_pending = false;
+#endif
+
   for (uint8_t i = 0; i < package_length; i++) {
     data[i] = state = this->receive_byte();
 
@@ -412,30 +1096,87 @@ int PJON_ASK::receive() {
     if(i == 0 && data[i] != _device_id && data[i] != BROADCAST)
       return BUSY;
 
-    if(i == 1)
-      if(data[i] > 3 && data[i] < PACKET_MAX_LENGTH)
-        package_length = data[i];
+    if(i == 1) {
+      uint8_t minimum = (data[i] & ROUTED) ? 5 : 3;
+#if defined(ENCRYPTION)
+      if(_encryption) minimum += CRYPTO_OVERHEAD;
+#endif
+      if((data[i] & ~(ROUTED | ENCODED)) > minimum &&
+         (data[i] & ~(ROUTED | ENCODED)) < PACKET_MAX_LENGTH)
+        package_length = data[i] & ~(ROUTED | ENCODED);
       else return FAIL;
+#if defined(ENCRYPTION)
+      if(_encryption) this->crypto_begin(data, package_length);
+#endif
+    }
 
     CRC ^= data[i];
+#if defined(ENCRYPTION)
+    this->crypto_received(i + 1);
+#endif
   }
 
-  if (!CRC) {
-    if(data[0] != BROADCAST && !_simplex) {
-      pinModeFast(_output_pin, OUTPUT);
-      this->send_byte(ACK);
-      digitalWriteFast(_input_pin, LOW);
+  boolean routed = data[1] & ROUTED;
+  boolean encoded = data[1] & ENCODED;
+  data[1] &= ~(ROUTED | ENCODED);
+  state = CRC ? NAK : ACK;
+
+  /* The MAC is verified and the content decrypted in place, then moved
+     over the nonce, so that the frame looks like a plain one */
+#if defined(ENCRYPTION)
+  if(_encryption) {
+    state = this->crypto_end(true) &&
+            this->nonce_accept(data[2], (uint32_t)data[3] << 16 | (uint32_t)data[4] << 8 | data[5]) ? ACK : NAK;
+    this->crypto_xor();
+    memmove(data + 2, data + 2 + NONCE_LENGTH, package_length - 2 - NONCE_LENGTH - MAC_LENGTH);
+    data[1] -= CRYPTO_OVERHEAD;
+  }
+#endif
+
+  uint8_t *payload = data + (routed ? 4 : 2);
+  uint8_t length = data[1] - (routed ? 5 : 3);
+
+  /* Encoded payloads are decoded before acknowledging, if the
+     reference payload is not available NAK is replied */
+#if defined(PAYLOAD_CODEC)
+  uint8_t decoded[PACKET_MAX_LENGTH];
+  if(state == ACK && encoded) {
+    int decoded_length = this->decode(payload, length, decoded);
+    if(decoded_length == FAIL) state = NAK;
+    else {
+      payload = decoded;
+      length = decoded_length;
     }
-    this->_receiver(data[1] - 3, data + 2);
+  }
+#else
+  if(encoded) state = NAK;
+#endif
+
+  /* Routed packets for other devices are forwarded before acknowledging
+     so that if the send list is full NAK is replied and the sender retries */
+  boolean forwarded = state == ACK && routed && data[2] != _device_id && data[2] != BROADCAST;
+#if defined(INCLUDE_ROUTING)
+  if(forwarded)
+    state = this->forward(data[2], data[3], (char *)data + 4, data[1] - 5);
+#else
+  if(forwarded)
+    this->_error(ROUTE_NOT_FOUND, data[2]);
+#endif
+
+  if(data[0] != BROADCAST && !_simplex)
+    this->send_response(state, data[package_length - 1] & 1);
+
+  if(state != ACK || forwarded) return state;
+
+#if defined(INCLUDE_TDMA)
+  if(_tdma == TDMA_NODE && data[0] == BROADCAST && !routed && !encoded && data[1] > 6 && data[2] == TDMA_BEACON) {
+    this->synchronize();
     return ACK;
-  } else {
-    if(data[0] != BROADCAST && !_simplex) {
-      pinModeFast(_output_pin, OUTPUT);
-      this->send_byte(NAK);
-      digitalWriteFast(_input_pin, LOW);
-    }
-    return NAK;
   }
+#endif
+
+  this->_receiver(length, payload);
+  return ACK;
 }
 
 
@@ -452,3 +1193,586 @@ int PJON_ASK::receive(unsigned long duration) {
   }
   return response;
 }
+
+
+#if defined(LOW_POWER_LISTEN)
+
+/* Listen for packets for the duration passed, sleeping in the meantime:
+   The MCU is put in power-down sleep mode, woken up by the watchdog or by the
+   carrier of an incoming preamble on the input pin. Sleep is interrupted
+   before the next packet in the send list is due, so listen() returns
+   TO_BE_SENT and the sketch can call update():
+
+  void loop() {
+    network.update();
+    network.listen(10000000);
+  }; */
+
+int PJON_ASK::listen(unsigned long duration) {
+  int response = FAIL;
+  unsigned long time = micros();
+  /* (freak condition used to avoid micros() overflow bug) */
+  while(!(micros() - time >= duration)) {
+    unsigned long remaining = duration - (micros() - time);
+    unsigned long deadline = this->next_deadline();
+
+    if(!deadline) return TO_BE_SENT;
+    if(deadline < remaining) remaining = deadline;
+
+    if(remaining < MIN_SLEEP_DURATION) {
+      response = this->receive();
+      if(response == ACK) return ACK;
+    } else if(this->sleep(remaining)) {
+      response = this->wake_receive();
+      if(response == ACK) return ACK;
+    }
+  }
+  return response;
+}
+
+
+/* Receive the packet after a pin change wake up: The carrier of the
+ preamble has to be still present (it lasts until the end of the first
+ byte's synchronization pad), if not the wake up is considered noise. */
+
+int PJON_ASK::wake_receive() {
+  if(!digitalReadFast(_input_pin)) return FAIL;
+  return this->receive();
+}
+
+
+/* Put the MCU in power-down sleep for about the duration passed:
+ The MCU sleeps in watchdog ticks of MIN_SLEEP_DURATION (the duration is
+ rounded down), every tick elapsed is added to millis() and micros().
+ Returns true if woken up by a pin change on the input pin, false if the
+ duration elapsed. The part of the tick slept before a pin change can't be
+ measured, half a tick is added, so the clock error is at most half a tick
+ (8ms) for every pin change wake up. */
+
+boolean PJON_ASK::sleep(unsigned long duration) {
+  pinModeFast(_input_pin, INPUT);
+  noInterrupts();
+  *digitalPinToPCMSK(_input_pin) |= bit(digitalPinToPCMSKbit(_input_pin));
+  *digitalPinToPCICR(_input_pin) |= bit(digitalPinToPCICRbit(_input_pin));
+
+  /* Watchdog in interrupt mode with the shortest period */
+  MCUSR &= ~bit(WDRF);
+  WDTCSR = bit(WDCE) | bit(WDE);
+  WDTCSR = bit(WDIE);
+  interrupts();
+
+  boolean pin_change = false;
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+
+  for(unsigned long slept = 0; !pin_change && slept + MIN_SLEEP_DURATION <= duration; ) {
+    watchdog_woke_up = false;
+    noInterrupts();
+    sleep_enable();
+    interrupts();
+    sleep_cpu();
+    sleep_disable();
+
+    if(watchdog_woke_up) {
+      sleep_credit(MIN_SLEEP_DURATION);
+      slept += MIN_SLEEP_DURATION;
+    } else {
+      sleep_credit(MIN_SLEEP_DURATION / 2);
+      pin_change = true;
+    }
+  }
+
+  wdt_disable();
+  *digitalPinToPCMSK(_input_pin) &= ~bit(digitalPinToPCMSKbit(_input_pin));
+  return pin_change;
+}
+
+
+/* Microseconds until the first packet of the send list (or the TDMA beacon
+   if master) is due, 0 if it has to be sent now, 0xFFFFFFFF if nothing is
+   scheduled. In TDMA mode the slot of the device is waited as well. */
+
+unsigned long PJON_ASK::next_deadline() {
+  unsigned long deadline = 0xFFFFFFFF;
+
+#if defined(INCLUDE_TDMA)
+  if(_tdma == TDMA_MASTER) {
+    unsigned long elapsed = micros() - _beacon_time;
+    unsigned long cycle = (unsigned long)_slot_duration * 1000 * _slots;
+    if(!_beacon_time || elapsed >= cycle) return 0;
+    deadline = cycle - elapsed;
+  }
+#endif
+
+  for(uint8_t i = 0; i < MAX_PACKETS; i++) {
+    if(packets[i].state == NULL) continue;
+
+    unsigned long wait = this->packet_due(i);
+#if defined(INCLUDE_TDMA)
+    /* In TDMA mode wait also the slot of the device (if synchronized but
+       missing from the slot map update() drops the packet when due) */
+    unsigned long slot = this->slot_wait(packets[i].length + 2);
+    if(_tdma && _beacon_time && _slot == NO_SLOT) slot = 0;
+    if(slot > wait) wait = slot;
+#endif
+
+    if(!wait) return 0;
+    if(wait < deadline) deadline = wait;
+  }
+  return deadline;
+}
+
+#endif
+
+
+#if defined(PAYLOAD_CODEC)
+
+/* Static dictionary used to compress text: in a compressed payload bytes
+   lower than 128 are literals, higher are the dictionary entry (byte - 128) */
+
+static const char codec_dictionary[][5] PROGMEM = {
+  "the ", "ing ", "and ", "ion ", " the", "tion", "ent", "ate", "ere", "her",
+  "tha", "for", "ter", "ver", "all", "est", "th", "he", "in", "er",
+  "an", "re", "on", "at", "en", "nd", "ti", "es", "or", "te",
+  "of", "ed", "is", "it", "al", "ar", "st", "to", "nt", "ng",
+  "se", "ha", "as", "ou", "io", "le", "ve", "co", "me", "de",
+  "hi", "ri", "ro", "ic", "ne", "ea", "ra", "ce", "e ", "s ",
+  "t ", "d ", " a", " t", ", ", ". ", ": ", "00", "0.", "OK"
+};
+
+#define CODEC_DICTIONARY_LENGTH (sizeof(codec_dictionary) / 5)
+
+
+/* Enable or disable the encoding of the packets transmitted: */
+
+void PJON_ASK::set_codec(boolean state) {
+  _codec = state;
+}
+
+
+/* Encode a payload in the buffer passed, returns the encoded length or FAIL
+ if encoding is not convenient (the payload has to be sent as it is).
+
+ Delta encoding (unicast payloads up to CODEC_MAX_LENGTH): the payload is
+ compared to the last one acknowledged by the recipient, a bitmap marks the
+ bytes changed whose zigzag encoded difference is packed in a nibble (values
+ over 14 are preceded by an escape nibble 15). Without a reference, or if
+ the delta is not shorter, the payload is sent as it is in a key frame.
+ The parity bit identifies the reference used, so that a retransmission
+ caused by a lost ACK is decoded against the previous reference by the
+ receiver.
+  ________ ________ ________________ _________________
+ | HEADER | SENDER | CHANGED BITMAP | NIBBLES (DELTA) |
+ |________|________|________________|_________________|
+
+ Text compression: bytes are substituted with codec_dictionary entries. */
+
+int PJON_ASK::encode(uint8_t ID, uint8_t *payload, uint8_t length, uint8_t *buffer) {
+  if(ID != BROADCAST && !_simplex && length <= CODEC_MAX_LENGTH) {
+    codec_peer *peer = this->codec_peer_of(ID, true);
+    uint8_t parity = (peer->flags & TX_PARITY) ? CODEC_PARITY : 0;
+    buffer[1] = _device_id;
+
+    if((peer->flags & TX_VALID) && peer->tx_length == length) {
+      buffer[0] = CODEC_DELTA | parity;
+      uint8_t position = 2 + (length + 7) / 8;
+      uint8_t nibbles = 0;
+      boolean shorter = true;
+      memset(buffer + 2, 0, position - 2);
+
+      for(uint8_t i = 0; i < length && shorter; i++) {
+        int8_t delta = payload[i] - peer->tx[i];
+        if(!delta) continue;
+
+        buffer[2 + i / 8] |= 1 << (i % 8);
+        uint8_t value = (delta << 1) ^ (delta >> 7);
+        uint8_t count = value < 15 ? 1 : 3;
+        if(position + (nibbles + count + 1) / 2 >= length + 2) shorter = false;
+
+        for(uint8_t n = 0; n < count && shorter; n++) {
+          uint8_t nibble = (count == 1) ? value : (n == 0) ? 15 : (n == 1) ? value >> 4 : value & 15;
+          if(nibbles & 1) buffer[position + nibbles / 2] |= nibble;
+          else buffer[position + nibbles / 2] = nibble << 4;
+          nibbles++;
+        }
+      }
+      if(shorter) return position + (nibbles + 1) / 2;
+    }
+
+    /* Without a reference, or if the delta is not shorter, a key frame is
+       sent so that the reference is updated (i.e. after a step change) */
+    buffer[0] = CODEC_KEY | parity;
+    memcpy(buffer + 2, payload, length);
+    return length + 2;
+  }
+
+  uint8_t position = 1;
+  buffer[0] = CODEC_TEXT;
+  for(uint8_t i = 0; i < length; ) {
+    if(payload[i] >= 128) return FAIL;
+
+    uint8_t match = 0;
+    uint8_t match_length = 0;
+    for(uint8_t e = 0; e < CODEC_DICTIONARY_LENGTH; e++) {
+      uint8_t l = 0;
+      while(i + l < length && pgm_read_byte(&codec_dictionary[e][l]) &&
+            pgm_read_byte(&codec_dictionary[e][l]) == payload[i + l])
+        l++;
+      if(l > match_length && !pgm_read_byte(&codec_dictionary[e][l])) {
+        match = e;
+        match_length = l;
+      }
+    }
+
+    if(position + 1 >= length) return FAIL;
+    if(match_length > 1) {
+      buffer[position++] = 128 + match;
+      i += match_length;
+    } else buffer[position++] = payload[i++];
+  }
+  return position;
+}
+
+
+/* Decode a payload in the buffer passed, returns the decoded length or
+   FAIL if the reference of a delta encoded payload is not available. */
+
+int PJON_ASK::decode(uint8_t *payload, uint8_t length, uint8_t *buffer) {
+  uint8_t type = payload[0] & CODEC_TYPE;
+
+  if(type == CODEC_TEXT) {
+    uint8_t decoded = 0;
+    for(uint8_t i = 1; i < length; i++) {
+      if(payload[i] < 128) {
+        if(decoded >= PACKET_MAX_LENGTH) return FAIL;
+        buffer[decoded++] = payload[i];
+        continue;
+      }
+      if((uint8_t)(payload[i] - 128) >= CODEC_DICTIONARY_LENGTH) return FAIL;
+      for(uint8_t l = 0; pgm_read_byte(&codec_dictionary[payload[i] - 128][l]); l++) {
+        if(decoded >= PACKET_MAX_LENGTH) return FAIL;
+        buffer[decoded++] = pgm_read_byte(&codec_dictionary[payload[i] - 128][l]);
+      }
+    }
+    return decoded;
+  }
+
+  if(length < 2) return FAIL;
+  codec_peer *peer = this->codec_peer_of(payload[1], type == CODEC_KEY);
+  if(peer == NULL) return FAIL;
+
+  uint8_t parity = (payload[0] & CODEC_PARITY) ? RX_PARITY : 0;
+
+  if(type == CODEC_KEY) {
+    length -= 2;
+    if(length > CODEC_MAX_LENGTH) return FAIL;
+    memcpy(buffer, payload + 2, length);
+    memcpy(peer->rx, buffer, length);
+    memcpy(peer->rx_previous, buffer, length);
+    peer->rx_length = peer->rx_previous_length = length;
+    /* The next payload will be encoded against this one */
+    peer->flags = (peer->flags & ~RX_PARITY) | RX_VALID | (parity ^ RX_PARITY);
+    return length;
+  }
+
+  if(type != CODEC_DELTA || !(peer->flags & RX_VALID)) return FAIL;
+
+  /* Parity different than expected: retransmission after a lost ACK */
+  boolean current = (peer->flags & RX_PARITY) == parity;
+  uint8_t *reference = current ? peer->rx : peer->rx_previous;
+  uint8_t decoded = current ? peer->rx_length : peer->rx_previous_length;
+  uint8_t position = 2 + (decoded + 7) / 8;
+  uint8_t nibbles = 0;
+
+  for(uint8_t i = 0; i < decoded; i++) {
+    buffer[i] = reference[i];
+    if(!(payload[2 + i / 8] & (1 << (i % 8)))) continue;
+
+    uint8_t value = 0;
+    for(uint8_t n = 0; n < 3; n++) {
+      if(position + nibbles / 2 >= length) return FAIL;
+      uint8_t nibble = payload[position + nibbles / 2];
+      nibble = (nibbles++ & 1) ? nibble & 15 : nibble >> 4;
+      if(n == 0 && nibble < 15) {
+        value = nibble;
+        break;
+      }
+      if(n == 1) value = nibble << 4;
+      if(n == 2) value |= nibble;
+    }
+    buffer[i] += (value >> 1) ^ -(value & 1);
+  }
+
+  if(current) {
+    memcpy(peer->rx_previous, peer->rx, peer->rx_length);
+    peer->rx_previous_length = peer->rx_length;
+    peer->flags ^= RX_PARITY;
+  }
+  memcpy(peer->rx, buffer, decoded);
+  peer->rx_length = decoded;
+  return decoded;
+}
+
+
+/* Update the delta encoding reference after the transmission of a key
+   or delta encoded payload: if acknowledged it becomes the reference,
+   NAK means that the recipient could not decode it, a key is sent next. */
+
+void PJON_ASK::codec_commit(uint8_t ID, uint8_t *payload, uint8_t length, uint8_t header, int response) {
+  if((header & CODEC_TYPE) == CODEC_TEXT) return;
+
+  codec_peer *peer = this->codec_peer_of(ID, false);
+  if(peer == NULL) return;
+
+  if(response == ACK) {
+    memcpy(peer->tx, payload, length);
+    peer->tx_length = length;
+    peer->flags = (peer->flags | TX_VALID) ^ TX_PARITY;
+  } else peer->flags &= ~TX_VALID;
+}
+
+
+/* Forget the delta encoding reference of a device (i.e. CONNECTION_LOST): */
+
+void PJON_ASK::codec_reset(uint8_t ID) {
+  codec_peer *peer = this->codec_peer_of(ID, false);
+  if(peer != NULL)
+    peer->flags &= ~TX_VALID;
+}
+
+
+/* Find the codec state of a device, if add is true and it is not present
+   a free slot is used or the oldest one added is replaced. */
+
+codec_peer *PJON_ASK::codec_peer_of(uint8_t ID, boolean add) {
+  for(uint8_t i = 0; i < CODEC_PEERS; i++)
+    if(_peers[i].flags && _peers[i].device_id == ID)
+      return &_peers[i];
+
+  if(!add) return NULL;
+
+  codec_peer *peer = NULL;
+  for(uint8_t i = 0; i < CODEC_PEERS && peer == NULL; i++)
+    if(!_peers[i].flags)
+      peer = &_peers[i];
+
+  if(peer == NULL)
+    peer = &_peers[_codec_evict++ % CODEC_PEERS];
+
+  peer->device_id = ID;
+  peer->flags = PEER_USED;
+  return peer;
+}
+
+#endif
+
+
+#if defined(ENCRYPTION)
+
+/* Set the 128 bits key shared by all the devices of the network, passing
+   a 16 bytes array, NULL disables encryption. The MAC polynomial key is
+   computed here encrypting a block no nonce can generate.
+
+  const uint8_t key[16] = {
+    0x3C, 0x1A, 0x7E, 0x52, 0x09, 0xD4, 0x61, 0xB8,
+    0x2F, 0x95, 0xC0, 0x4B, 0xE7, 0x13, 0x8A, 0x76
+  };
+  network.set_key(key); */
+
+void PJON_ASK::set_key(const uint8_t *key) {
+  _encryption = key != NULL;
+  if(!_encryption) return;
+
+  for(uint8_t i = 0; i < 4; i++)
+    _key[i] = (uint32_t)key[i * 4] << 24 | (uint32_t)key[i * 4 + 1] << 16 |
+              (uint32_t)key[i * 4 + 2] << 8 | key[i * 4 + 3];
+
+  _xtea_v0 = 0xFFFFFFFF;
+  _xtea_v1 = 0xFFFFFFFF;
+  _xtea_sum = 0;
+  this->xtea(32);
+  _mac_r = (_xtea_v0 & 0x7FFF) + 1;
+
+  /* Frame counters received with the previous key are forgotten */
+  for(uint8_t i = 0; i < REPLAY_PEERS; i++)
+    _replay[i].counter = 0;
+}
+
+
+/* Set the frame counter sent in the nonce, has to be called before
+   transmitting: a nonce must never be reused with the same key, so after a
+   reset the counter has to be restored. It can be saved in EEPROM
+   reserving a block of values (see examples/Encryption/Transmitter):
+
+  uint32_t reserved;
+  EEPROM.get(0, reserved);
+  network.set_nonce(reserved);
+  EEPROM.put(0, reserved + NONCE_RESERVE); */
+
+void PJON_ASK::set_nonce(uint32_t nonce) {
+  _nonce = nonce > NONCE_MAX ? NONCE_MAX : nonce;
+  _nonce_seeded = true;
+}
+
+
+/* Get the last frame counter used: */
+
+uint32_t PJON_ASK::get_nonce() {
+  return _nonce;
+}
+
+
+/* Check if a frame can be encrypted: if the counter was not seeded with
+   set_nonce() or all the counters were used the error is thrown. */
+
+boolean PJON_ASK::nonce_available(uint8_t ID) {
+  if(!_encryption) return true;
+  if(_nonce_seeded && _nonce < NONCE_MAX) return true;
+
+  this->_error(_nonce_seeded ? NONCE_EXHAUSTED : NONCE_NOT_SEEDED, ID);
+  return false;
+}
+
+
+/* Reject replayed frames: the frame counter of an authenticated frame has
+   to be higher than the last one received from the same sender. Only the
+   last REPLAY_PEERS senders are remembered (the oldest one is replaced),
+   after a reset of the receiver old frames are accepted once. */
+
+boolean PJON_ASK::nonce_accept(uint8_t device_id, uint32_t counter) {
+  replay_peer *peer = NULL;
+  for(uint8_t i = 0; i < REPLAY_PEERS && peer == NULL; i++)
+    if(_replay[i].counter && _replay[i].device_id == device_id)
+      peer = &_replay[i];
+
+  if(peer == NULL) {
+    for(uint8_t i = 0; i < REPLAY_PEERS && peer == NULL; i++)
+      if(!_replay[i].counter)
+        peer = &_replay[i];
+    if(peer == NULL)
+      peer = &_replay[_replay_next++ % REPLAY_PEERS];
+    peer->device_id = device_id;
+  } else if(counter <= peer->counter) return false;
+
+  peer->counter = counter;
+  return true;
+}
+
+
+/* Prepare the encryption of the frame passed (of the total length passed,
+   MAC included): The keystream is generated in blocks of 8 bytes encrypting
+   the nonce and the block index, the first MAC_LENGTH bytes of it are used to
+   mask the MAC, the following ones are xored with the bytes after the nonce.
+   Nothing is computed here, the work is done by crypto_step(). The frame is
+   considered available up to the nonce, receiving the count is updated
+   by receive() as bytes come in. */
+
+void PJON_ASK::crypto_begin(uint8_t *frame, uint8_t length) {
+  _crypto_frame = frame;
+  _crypto_length = length;
+  _crypto_received = 2 + NONCE_LENGTH;
+  _ks_block = 0;
+  _ks_blocks = (length - 2 - NONCE_LENGTH + 7) / 8;
+  _xtea_cycle = 0;
+  _mac_hash = 0;
+  _mac_count = 0;
+  _crypto_pending = true;
+}
+
+
+/* Compute a little part of the pending work: the bytes received since the
+   last call are added to the MAC and XTEA_STEP cycles of the current
+   keystream block are computed (once the nonce is available). It returns
+   true until the keystream is complete. The MAC is a polynomial hash
+   modulo 65537 of the frame bytes up to the MAC, masked with the
+   keystream (Carter-Wegman). */
+
+boolean PJON_ASK::crypto_step() {
+  uint8_t end = _crypto_length - MAC_LENGTH;
+  if(_crypto_received < end) end = _crypto_received;
+
+  while(_mac_count < end) {
+    /* (h + c) * r fits 32 bits being h <= 65536 and r <= 32768,
+       x mod 65537 is computed as (x & 0xFFFF) - (x >> 16) */
+    uint32_t x = (_mac_hash + _crypto_frame[_mac_count++]) * _mac_r;
+    int32_t h = (int32_t)(x & 0xFFFF) - (int32_t)(x >> 16);
+    _mac_hash = h < 0 ? h + 65537 : h;
+  }
+
+  if(_ks_block < _ks_blocks && _crypto_received >= 2 + NONCE_LENGTH) {
+    if(!_xtea_cycle) {
+      _xtea_v0 = (uint32_t)_crypto_frame[2] << 24 | (uint32_t)_crypto_frame[3] << 16 |
+                 (uint32_t)_crypto_frame[4] << 8 | _crypto_frame[5];
+      _xtea_v1 = _ks_block;
+      _xtea_sum = 0;
+    }
+
+    this->xtea(XTEA_STEP);
+    _xtea_cycle += XTEA_STEP;
+
+    if(_xtea_cycle >= 32) {
+      uint8_t *block = _keystream + _ks_block * 8;
+      for(uint8_t i = 0; i < 4; i++) {
+        block[i] = _xtea_v0 >> (24 - i * 8);
+        block[i + 4] = _xtea_v1 >> (24 - i * 8);
+      }
+      _xtea_cycle = 0;
+      _ks_block++;
+    }
+  }
+
+  return _ks_block < _ks_blocks;
+}
+
+
+/* Set the count of frame bytes received, crypto_step() adds to the MAC
+   only the bytes available and waits for the nonce to compute keystream */
+
+void PJON_ASK::crypto_received(uint8_t count) {
+  _crypto_received = count;
+}
+
+
+/* Compute XTEA cycles (two Feistel rounds each) on the current block */
+
+void PJON_ASK::xtea(uint8_t cycles) {
+  uint32_t v0 = _xtea_v0, v1 = _xtea_v1, sum = _xtea_sum;
+  for(uint8_t i = 0; i < cycles; i++) {
+    v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + _key[sum & 3]);
+    sum += 0x9E3779B9;
+    v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + _key[(sum >> 11) & 3]);
+  }
+  _xtea_v0 = v0;
+  _xtea_v1 = v1;
+  _xtea_sum = sum;
+}
+
+
+/* Encrypt or decrypt the bytes between the nonce and the MAC */
+
+void PJON_ASK::crypto_xor() {
+  for(uint8_t i = 2 + NONCE_LENGTH; i < _crypto_length - MAC_LENGTH; i++)
+    _crypto_frame[i] ^= _keystream[MAC_LENGTH + i - 2 - NONCE_LENGTH];
+}
+
+
+/* Complete the pending work and write the MAC at the end of the frame or,
+   if verify is true, compare it with the one received: */
+
+boolean PJON_ASK::crypto_end(boolean verify) {
+  _crypto_received = _crypto_length;
+  while(this->crypto_step());
+  _crypto_pending = false;
+
+  uint16_t tag = _mac_hash + _keystream[0];
+  if(MAC_LENGTH > 1) tag += _keystream[1] << 8;
+  uint8_t *mac = _crypto_frame + _crypto_length - MAC_LENGTH;
+  boolean valid = true;
+
+  for(uint8_t i = 0; i < MAC_LENGTH; i++) {
+    if(verify) valid &= mac[i] == (uint8_t)(tag >> (i * 8));
+    else mac[i] = tag >> (i * 8);
+  }
+  return valid;
+}
+
+#endif
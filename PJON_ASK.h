@@ -74,24 +74,266 @@ or otherwise) arising in any way out of the use of this software, even if advise
 #define PACKETS_BUFFER_FULL 102
 #define MEMORY_FULL 103
 #define CONTENT_TOO_LONG 104
+#define ROUTE_NOT_FOUND 105
+#define HOPS_EXCEEDED 106
+#define NONCE_NOT_SEEDED 107
+#define NONCE_EXHAUSTED 108
+#define TIMING_TOO_LONG 109
+#define SLOT_NOT_ASSIGNED 110
+
+/* Compile time configuration: the sizes below can be edited here or passed
+   as build flags (i.e. -DMAX_PACKETS=3). Uncomment SMALL_FOOTPRINT to reduce
+   the default sizes, store packet times in 16 bits and exclude TDMA and
+   routing (define INCLUDE_TDMA or INCLUDE_ROUTING to keep them), for devices
+   with little RAM like ATtiny45/85. LOW_POWER_LISTEN, PAYLOAD_CODEC,
+   ENCRYPTION and COMPACT_ACK are included only if defined. */
+// #define SMALL_FOOTPRINT
+
+#if !defined(SMALL_FOOTPRINT)
+  #define INCLUDE_TDMA
+  #define INCLUDE_ROUTING
+#endif
 
 // Maximum sending attempts before throwing CONNECTON_LOST error
-#define MAX_ATTEMPTS 250
+#ifndef MAX_ATTEMPTS
+  #define MAX_ATTEMPTS 250
+#endif
+
+// Longest wait after a failure, in durations of the packet frame
+#ifndef MAX_BACKOFF
+  #define MAX_BACKOFF 8
+#endif
 
 // Packets buffer length, if full PACKET_BUFFER_FULL error is thrown
-#define MAX_PACKETS 10
+#ifndef MAX_PACKETS
+  #if defined(SMALL_FOOTPRINT)
+    #define MAX_PACKETS 3
+  #else
+    #define MAX_PACKETS 10
+  #endif
+#endif
+
+// Max packet length, higher if necessary (affects memory, has to be lower than ENCODED)
+#ifndef PACKET_MAX_LENGTH
+  #if defined(SMALL_FOOTPRINT)
+    #define PACKET_MAX_LENGTH 20
+  #else
+    #define PACKET_MAX_LENGTH 50
+  #endif
+#endif
+
+/* Routing: the LENGTH byte of a routed frame has the ROUTED bit set and
+   is followed by the final destination id and the remaining hops (TTL) */
+#define ROUTED 128
+// Hops a routed packet can do before being dropped
+#ifndef MAX_HOPS
+  #define MAX_HOPS 8
+#endif
+// Routing table length
+#ifndef MAX_ROUTES
+  #define MAX_ROUTES 8
+#endif
+// Send list slots reserved to locally generated packets (not forwarded)
+#ifndef FORWARD_RESERVED
+  #define FORWARD_RESERVED 2
+#endif
+
+/* Uncomment to include the payload codec: payloads up to CODEC_MAX_LENGTH
+   are delta encoded against the last one acknowledged by the same device,
+   text is compressed with a static dictionary. Has to be included in every
+   device of the network, encoding is enabled with set_codec(). */
+// #define PAYLOAD_CODEC
+
+// The LENGTH byte of an encoded frame has the ENCODED bit set
+#define ENCODED 64
+#if PACKET_MAX_LENGTH > ENCODED
+  #error PACKET_MAX_LENGTH has to be lower than ENCODED (the LENGTH byte carries the ROUTED and ENCODED flags)
+#endif
+// Longest payload delta encoded (affects memory)
+#ifndef CODEC_MAX_LENGTH
+  #define CODEC_MAX_LENGTH 8
+#endif
+// Devices whose last payload is kept for delta encoding (affects memory)
+#ifndef CODEC_PEERS
+  #if defined(SMALL_FOOTPRINT)
+    #define CODEC_PEERS 1
+  #else
+    #define CODEC_PEERS 4
+  #endif
+#endif
+
+// Codec header, first byte of an encoded payload
+#define CODEC_KEY 64
+#define CODEC_DELTA 128
+#define CODEC_TEXT 192
+#define CODEC_TYPE 192
+#define CODEC_PARITY 1
 
-// Max packet length, higher if necessary (affects memory)
-#define PACKET_MAX_LENGTH 50
+// Codec peer state flags
+#define TX_VALID 1
+#define TX_PARITY 2
+#define RX_VALID 4
+#define RX_PARITY 8
+#define PEER_USED 16
+
+/* Uncomment to include payload encryption: XTEA in counter mode with a
+   pre-shared 128 bits key, the CRC byte is replaced by a MAC. The keystream
+   is generated before transmission and, receiving, a step at a time during
+   the start bit of every byte. Has to be included in every device of the
+   network, encryption is enabled with set_key(). */
+// #define ENCRYPTION
+
+// Nonce sent after the LENGTH byte: sender id and 24 bits frame counter
+#define NONCE_LENGTH 4
+// Highest frame counter, once reached nothing is sent (a new key has to be used)
+#define NONCE_MAX 0xFFFFFF
+// Senders whose last frame counter is kept to reject replayed frames
+#ifndef REPLAY_PEERS
+  #if defined(SMALL_FOOTPRINT)
+    #define REPLAY_PEERS 1
+  #else
+    #define REPLAY_PEERS 4
+  #endif
+#endif
+// MAC bytes replacing the CRC (1 or 2)
+#ifndef MAC_LENGTH
+  #define MAC_LENGTH 1
+#endif
+// XTEA cycles computed per crypto_step() (has to divide 32, a step has to last less than BIT_WIDTH)
+#ifndef XTEA_STEP
+  #define XTEA_STEP 8
+#endif
+
+#if defined(ENCRYPTION)
+  #define CRYPTO_OVERHEAD (NONCE_LENGTH + MAC_LENGTH - 1)
+#else
+  #define CRYPTO_OVERHEAD 0
+#endif
+
+/* Uncomment to enable low-power listen: the MCU is put in power-down sleep
+   and woken up by a pin change interrupt on the input pin or by the watchdog.
+   Defines the PCINT and WDT interrupt vectors, so it can't coexist with other
+   libraries using them (i.e. SoftwareSerial). Standard AVR core only. */
+// #define LOW_POWER_LISTEN
+
+/* Suggested preamble duration (microseconds) transmitting to sleeping devices:
+   has to cover the receiver's wake-up time (16K clock cycles with the default
+   crystal fuses, 1ms at 16Mhz) plus a margin */
+#define WAKE_UP_PREAMBLE 2000
+
+// Watchdog tick the sleep is made of, its shortest period (microseconds)
+#define MIN_SLEEP_DURATION 16000
+
+/* Uncomment to acknowledge with a single pulse instead of a byte, a long
+   ACK_PULSE or a short NAK_PULSE (has to be used by every device) */
+// #define COMPACT_ACK
+/* Uncomment to follow the compact ACK pulse with a check bit (after a
+   BIT_WIDTH pause), the lowest bit of the CRC of the packet acknowledged */
+// #define ACK_CHECK_BIT
+
+#define ACK_PULSE (BIT_WIDTH * 2)
+#define NAK_PULSE BIT_WIDTH
+
+/* Longest time a receiver can spend before responding (decoding, forwarding
+   and, with ENCRYPTION, completing keystream and MAC of a short packet) */
+#ifndef ACK_PROCESSING
+  #if defined(ENCRYPTION)
+    #define ACK_PROCESSING (BIT_WIDTH * 2 + BIT_WIDTH / 2)
+  #else
+    #define ACK_PROCESSING (BIT_WIDTH / 2)
+  #endif
+#endif
+
+/* Maximum time waited for the response after a packet (microseconds), then
+   shortened to the delay measured for each device plus ACK_MARGIN, but never
+   shorter than ACK_PROCESSING plus ACK_MARGIN */
+#define ACK_MARGIN (BIT_WIDTH / 2)
+#define ACK_TIMEOUT (BIT_SPACER + ACK_MARGIN + ACK_PROCESSING)
+// Devices whose response delay is measured
+#ifndef ACK_PEERS
+  #if defined(SMALL_FOOTPRINT)
+    #define ACK_PEERS 1
+  #else
+    #define ACK_PEERS 4
+  #endif
+#endif
+
+// Air time of a byte, synchronization pad included (microseconds)
+#define BYTE_DURATION (BIT_SPACER + BIT_WIDTH * 9)
+
+// Time slotted (TDMA) mode
+#define TDMA_NODE 1
+#define TDMA_MASTER 2
+// First payload byte of a broadcast beacon (reserved if TDMA is active)
+#define TDMA_BEACON 254
+// Device not present in the slot map
+#define NO_SLOT 255
+// Maximum number of slots in a beacon's slot map
+#ifndef MAX_SLOTS
+  #define MAX_SLOTS 16
+#endif
+// Missed beacons before considering the device not synchronized
+#define TDMA_MAX_MISSED 4
+
+/* With SMALL_FOOTPRINT packet times are stored in 16 bits in units of
+   2^TIME_SHIFT microseconds (1.024ms), so timing can be at most ~67 seconds
+   (longer ones are rejected with TIMING_TOO_LONG, the others are rounded
+   up so that a short one is not taken as 0), and state in a byte
+   (FAIL and BUSY are never stored in the send list) */
+#if defined(SMALL_FOOTPRINT)
+  #define TIME_SHIFT 10
+  typedef uint16_t packet_time;
+  typedef uint8_t  packet_state;
+#else
+  #define TIME_SHIFT 0
+  typedef unsigned long packet_time;
+  typedef int packet_state;
+#endif
+
+#define PACKET_TIME(t) ((packet_time)((t) >> TIME_SHIFT))
+#define PACKET_MICROS(t) ((unsigned long)(t) << TIME_SHIFT)
+
+class PJON_ASK;
 
 struct packet {
   uint8_t attempts;
   uint8_t device_id;
+#if defined(INCLUDE_ROUTING)
+  uint8_t destination;
+  uint8_t ttl;
+#endif
   char *content;
   uint8_t length;
-  unsigned long registration;
-  int state;
-  unsigned long timing;
+  packet_time registration;
+  packet_state state;
+  packet_time timing;
+};
+
+struct codec_peer {
+  uint8_t device_id;
+  uint8_t flags;
+  uint8_t tx_length;
+  uint8_t rx_length;
+  uint8_t rx_previous_length;
+  uint8_t tx[CODEC_MAX_LENGTH];
+  uint8_t rx[CODEC_MAX_LENGTH];
+  uint8_t rx_previous[CODEC_MAX_LENGTH];
+};
+
+struct ack_peer {
+  uint8_t device_id;
+  unsigned int delay;
+};
+
+struct replay_peer {
+  uint8_t device_id;
+  uint32_t counter;
+};
+
+struct route {
+  uint8_t destination;
+  uint8_t via;
+  PJON_ASK *bus;
 };
 
 typedef void (* receiver)(uint8_t length, uint8_t *payload);
@@ -111,18 +353,74 @@ class PJON_ASK {
     void set_id(uint8_t id);
     void set_receiver(receiver r);
     void set_error(error e);
+    void set_preamble(unsigned long duration);
+#if defined(INCLUDE_TDMA)
+    void set_tdma(boolean state);
+    void set_tdma_master(uint8_t *slot_map, uint8_t slots, unsigned int slot_duration);
+#endif
 
     int receive_byte();
+    int receive_response(uint8_t check);
     int receive();
     int receive(unsigned long duration);
 
+#if defined(LOW_POWER_LISTEN)
+    int  listen(unsigned long duration);
+    int  wake_receive();
+    boolean sleep(unsigned long duration);
+    unsigned long next_deadline();
+#endif
+
+#if defined(PAYLOAD_CODEC)
+    void set_codec(boolean state);
+    int  encode(uint8_t ID, uint8_t *payload, uint8_t length, uint8_t *buffer);
+    int  decode(uint8_t *payload, uint8_t length, uint8_t *buffer);
+    void codec_commit(uint8_t ID, uint8_t *payload, uint8_t length, uint8_t header, int response);
+    void codec_reset(uint8_t ID);
+    codec_peer *codec_peer_of(uint8_t ID, boolean add);
+#endif
+
+#if defined(ENCRYPTION)
+    void set_key(const uint8_t *key);
+    void set_nonce(uint32_t nonce);
+    uint32_t get_nonce();
+    boolean nonce_available(uint8_t ID);
+    boolean nonce_accept(uint8_t device_id, uint32_t counter);
+    void crypto_begin(uint8_t *frame, uint8_t length);
+    boolean crypto_step();
+    void crypto_received(uint8_t count);
+    void crypto_xor();
+    boolean crypto_end(boolean verify);
+    void xtea(uint8_t cycles);
+#endif
+
     void send_bit(uint8_t VALUE, int duration);
     void send_byte(uint8_t b);
-    int  send_string(uint8_t ID, char *string, uint8_t length);
+    void send_response(uint8_t response, uint8_t check);
+    int  send_string(uint8_t ID, char *string, uint8_t length, uint8_t destination = 0, uint8_t ttl = 0);
     int  send(uint8_t ID, char *packet, uint8_t length, unsigned long timing = 0);
+    int  dispatch(uint8_t ID, uint8_t destination, uint8_t ttl, char *packet, uint8_t length, unsigned long timing);
+
+#if defined(INCLUDE_ROUTING)
+    int  add_route(uint8_t destination, uint8_t via, PJON_ASK *bus = NULL);
+    int  forward(uint8_t destination, uint8_t ttl, char *packet, uint8_t length);
+#endif
 
     void update();
     void remove(int id);
+    unsigned long packet_due(uint8_t id);
+
+    unsigned long ack_timeout(uint8_t ID);
+    void ack_measure(uint8_t ID, int response, unsigned long delay);
+
+#if defined(INCLUDE_TDMA)
+    void send_beacon();
+    void synchronize();
+    unsigned long slot_wait(uint8_t length);
+    unsigned long slot_airtime(uint8_t length);
+    boolean slot_fits(uint8_t length);
+    unsigned long cycle_duration();
+#endif
 
     uint8_t read_byte();
     boolean can_start();
@@ -135,6 +433,54 @@ class PJON_ASK {
     int       _input_pin;
     int       _output_pin;
     boolean   _simplex;
+    unsigned long _preamble;
+
+#if defined(INCLUDE_TDMA)
+    uint8_t   _tdma;
+    uint8_t   _slot;
+    uint8_t   _slots;
+    uint8_t   _slot_map[MAX_SLOTS];
+    unsigned int  _slot_duration;
+    unsigned long _beacon_time;
+    unsigned long _drift;
+#endif
+
+    ack_peer  _ack_peers[ACK_PEERS];
+    uint8_t   _ack_next;
+
+#if defined(INCLUDE_ROUTING)
+    route     _routes[MAX_ROUTES];
+    uint8_t   _route_count;
+#endif
+
+#if defined(PAYLOAD_CODEC)
+    boolean   _codec;
+    uint8_t   _codec_evict;
+    codec_peer _peers[CODEC_PEERS];
+#endif
+
+#if defined(ENCRYPTION)
+    boolean   _encryption;
+    uint32_t  _key[4];
+    uint32_t  _nonce;
+    boolean   _nonce_seeded;
+    replay_peer _replay[REPLAY_PEERS];
+    uint8_t   _replay_next;
+    uint8_t   _keystream[(PACKET_MAX_LENGTH + 7) & ~7];
+    uint8_t   _ks_block;
+    uint8_t   _ks_blocks;
+    uint8_t   _xtea_cycle;
+    uint32_t  _xtea_v0;
+    uint32_t  _xtea_v1;
+    uint32_t  _xtea_sum;
+    uint16_t  _mac_r;
+    uint32_t  _mac_hash;
+    uint8_t   _mac_count;
+    uint8_t  *_crypto_frame;
+    uint8_t   _crypto_length;
+    uint8_t   _crypto_received;
+    boolean   _crypto_pending;
+#endif
     receiver  _receiver;
     error     _error;
 };
@@ -0,0 +1,120 @@
+#include <EEPROM.h>
+#include <PJON_ASK.h>
+
+/* Uncomment #define ENCRYPTION in PJON_ASK.h to compile this example.
+   Measures the cost of the encryption on the device and shows that the
+   transmission timing is not affected, results are printed on Serial:
+   - Keystream and MAC computation in clock cycles per byte
+   - Longest crypto_step() computed during the start bit of each byte
+     received, has to be shorter than BIT_WIDTH
+   - Airtime per byte with and without encryption, has to be BYTE_DURATION
+   The frame counter is restored from EEPROM as in the transmitter example. */
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 45);
+
+const uint8_t key[16] = {
+  0x3C, 0x1A, 0x7E, 0x52, 0x09, 0xD4, 0x61, 0xB8,
+  0x2F, 0x95, 0xC0, 0x4B, 0xE7, 0x13, 0x8A, 0x76
+};
+
+#define SHORT_CONTENT 10
+#define LONG_CONTENT (PACKET_MAX_LENGTH - 3 - CRYPTO_OVERHEAD - 1)
+#define ITERATIONS 100
+
+char content[PACKET_MAX_LENGTH];
+uint8_t frame[PACKET_MAX_LENGTH];
+
+// Microseconds spent computing keystream and MAC of a frame before sending it
+unsigned long precompute(uint8_t length) {
+  uint8_t total = length + 3 + CRYPTO_OVERHEAD;
+  unsigned long time = micros();
+  for(uint8_t i = 0; i < ITERATIONS; i++) {
+    network.crypto_begin(frame, total);
+    while(network.crypto_step());
+    network.crypto_xor();
+    network.crypto_end(false);
+  }
+  return (micros() - time) / ITERATIONS;
+}
+
+/* Longest step receiving a frame, a byte at a time: as in receive() the
+   step computed during the start bit of a byte sees the bytes before it */
+unsigned long worst_step(uint8_t length) {
+  uint8_t total = length + 3 + CRYPTO_OVERHEAD;
+  unsigned long worst = 0;
+  network.crypto_begin(frame, total);
+  for(uint8_t i = 2; i < total; i++) {
+    network.crypto_received(i);
+    unsigned long time = micros();
+    network.crypto_step();
+    time = micros() - time;
+    if(time > worst) worst = time;
+  }
+  network.crypto_end(true);
+  return worst;
+}
+
+// Microseconds needed to send a broadcast packet (no acknowledge)
+unsigned long send_duration(uint8_t length) {
+  unsigned long time;
+  int response;
+  do {
+    time = micros();
+    response = network.send_string(BROADCAST, content, length);
+    time = micros() - time;
+  } while(response != ACK);
+  return time;
+}
+
+void setup() {
+  Serial.begin(115200);
+  for(uint8_t i = 0; i < PACKET_MAX_LENGTH; i++) {
+    content[i] = 'a' + i % 26;
+    frame[i] = i;
+  }
+  uint32_t reserved;
+  EEPROM.get(0, reserved);
+  if(reserved > NONCE_MAX) reserved = 0;
+  network.set_nonce(reserved);
+  EEPROM.put(0, reserved + 256);
+  network.set_key(key);
+
+  unsigned long short_pre = precompute(SHORT_CONTENT);
+  unsigned long long_pre = precompute(LONG_CONTENT);
+  uint8_t bytes = LONG_CONTENT + 3 + CRYPTO_OVERHEAD;
+
+  Serial.print("Keystream and MAC: ");
+  Serial.print(long_pre * clockCyclesPerMicrosecond() / bytes);
+  Serial.print(" cycles/byte, ");
+  Serial.print(long_pre);
+  Serial.print("us for ");
+  Serial.print(bytes);
+  Serial.println(" bytes");
+
+  unsigned long worst = max(worst_step(SHORT_CONTENT), worst_step(LONG_CONTENT));
+  Serial.print("Longest step receiving: ");
+  Serial.print(worst);
+  Serial.print("us, BIT_WIDTH ");
+  Serial.print(BIT_WIDTH);
+  Serial.println(worst < BIT_WIDTH / 2 ? "us OK" : "us TOO LONG, reduce XTEA_STEP");
+
+  /* The airtime per byte is measured as the difference between the
+     sending durations of a long and a short packet, excluding the
+     precomputation, and divided by the difference of their lengths */
+  network.set_key(NULL);
+  long plain = send_duration(LONG_CONTENT) - send_duration(SHORT_CONTENT);
+  network.set_key(key);
+  long encrypted = (send_duration(LONG_CONTENT) - long_pre) -
+                   (send_duration(SHORT_CONTENT) - short_pre);
+
+  Serial.print("Airtime per byte: plain ");
+  Serial.print(plain / (LONG_CONTENT - SHORT_CONTENT));
+  Serial.print("us, encrypted ");
+  Serial.print(encrypted / (LONG_CONTENT - SHORT_CONTENT));
+  Serial.print("us, BYTE_DURATION ");
+  Serial.print(BYTE_DURATION);
+  Serial.println("us");
+};
+
+void loop() {};
@@ -0,0 +1,32 @@
+#include <PJON_ASK.h>
+
+/* Uncomment #define ENCRYPTION in PJON_ASK.h to compile this example
+   (on both transmitter and receiver). */
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 44);
+
+// The same key has to be set on all the devices of the network
+const uint8_t key[16] = {
+  0x3C, 0x1A, 0x7E, 0x52, 0x09, 0xD4, 0x61, 0xB8,
+  0x2F, 0x95, 0xC0, 0x4B, 0xE7, 0x13, 0x8A, 0x76
+};
+
+void setup() {
+  Serial.begin(115200);
+  /* This device only replies (responses are not encrypted), if it transmitted
+     its frame counter would have to be restored (see the transmitter). */
+  network.set_key(key);
+  network.set_receiver(receiver_function);
+};
+
+static void receiver_function(uint8_t length, uint8_t *payload) {
+  // Payload is received decrypted, packets with a wrong MAC or replayed are discarded
+  for(uint8_t i = 0; i < length; i++)
+    Serial.print((char)payload[i]);
+  Serial.println();
+}
+
+void loop() {
+  network.receive(1000);
+};
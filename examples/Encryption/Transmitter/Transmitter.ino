@@ -0,0 +1,57 @@
+#include <EEPROM.h>
+#include <PJON_ASK.h>
+
+/* Uncomment #define ENCRYPTION in PJON_ASK.h to compile this example
+   (on both transmitter and receiver). */
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 45);
+
+// The same key has to be set on all the devices of the network
+const uint8_t key[16] = {
+  0x3C, 0x1A, 0x7E, 0x52, 0x09, 0xD4, 0x61, 0xB8,
+  0x2F, 0x95, 0xC0, 0x4B, 0xE7, 0x13, 0x8A, 0x76
+};
+
+/* The frame counter is never reused: a block of NONCE_RESERVE values is
+   reserved in EEPROM, at boot the counter restarts after the last block
+   reserved (up to NONCE_RESERVE values are skipped, EEPROM is written
+   once every NONCE_RESERVE frames). */
+#define NONCE_RESERVE 256
+uint32_t reserved;
+
+char content[] = "encrypted";
+
+void setup() {
+  Serial.begin(115200);
+  EEPROM.get(0, reserved);
+  // Erased EEPROM (0xFFFFFFFF)
+  if(reserved > NONCE_MAX) reserved = 0;
+  network.set_nonce(reserved);
+  reserved += NONCE_RESERVE;
+  EEPROM.put(0, reserved);
+
+  network.set_key(key);
+  network.set_error(error_handler);
+}
+
+static void error_handler(uint8_t code, uint8_t data) {
+  if(code == NONCE_EXHAUSTED)
+    Serial.println("Frame counter exhausted, a new key has to be used");
+}
+
+unsigned long time = millis();
+
+void loop() {
+  // Reserve the next block before the current one is used up
+  if(reserved - network.get_nonce() < MAX_PACKETS * 2) {
+    reserved += NONCE_RESERVE;
+    EEPROM.put(0, reserved);
+  }
+
+  if(millis() - time > 1000) {
+    time = millis();
+    network.send(44, content, 9);
+  }
+  network.update();
+};
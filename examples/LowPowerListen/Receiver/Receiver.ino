@@ -0,0 +1,29 @@
+#include <PJON_ASK.h>
+
+/* Uncomment #define LOW_POWER_LISTEN in PJON_ASK.h to compile this example.
+   The input pin has to support pin change interrupts. */
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 44);
+
+void setup() {
+  pinMode(13, OUTPUT);
+  digitalWrite(13, LOW);
+  network.set_receiver(receiver_function);
+  // Accepted carrier duration before a packet
+  network.set_preamble(WAKE_UP_PREAMBLE);
+};
+
+static void receiver_function(uint8_t length, uint8_t *payload) {
+  if(payload[0] == 'B') {
+    digitalWrite(13, HIGH);
+    delay(30);
+    digitalWrite(13, LOW);
+  }
+}
+
+void loop() {
+  network.update();
+  // Sleep until a packet comes or a packet in the send list is due
+  network.listen(10000000);
+};
@@ -0,0 +1,26 @@
+#include <PJON_ASK.h>
+
+/* Uncomment #define PAYLOAD_CODEC in PJON_ASK.h to compile this example
+   (on both transmitter and receiver). */
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 44);
+
+void setup() {
+  Serial.begin(115200);
+  network.set_receiver(receiver_function);
+};
+
+static void receiver_function(uint8_t length, uint8_t *payload) {
+  // Payload is received decoded as it was passed to send()
+  if(payload[0] != 'T') return;
+  for(uint8_t i = 1; i < length; i += 2) {
+    Serial.print(payload[i] << 8 | payload[i + 1] & 0xFF);
+    Serial.print(" ");
+  }
+  Serial.println();
+}
+
+void loop() {
+  network.receive(1000);
+};
@@ -0,0 +1,31 @@
+#include <PJON_ASK.h>
+
+/* Uncomment #define PAYLOAD_CODEC in PJON_ASK.h to compile this example
+   (on both transmitter and receiver). */
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 45);
+
+void setup() {
+  // Delta encode payloads against the last acknowledged one
+  network.set_codec(true);
+}
+
+unsigned long time = millis();
+
+void loop() {
+  if(millis() - time > 1000) {
+    time = millis();
+    char content[7];
+    // The first byte can't be 0, a tag is used
+    content[0] = 'T';
+    // 3 slowly changing readings, 2 bytes each (up to CODEC_MAX_LENGTH)
+    for(uint8_t i = 0; i < 3; i++) {
+      int reading = analogRead(A0 + i);
+      content[1 + i * 2] = reading >> 8;
+      content[2 + i * 2] = reading & 0xFF;
+    }
+    network.send(44, content, 7);
+  }
+  network.update();
+};
@@ -0,0 +1,22 @@
+#include <PJON_ASK.h>
+
+/* Router connecting two radio channels, each with its own transceivers:
+   bus_a(input pin, output pin, device id) */
+PJON_ASK bus_a(11, 12, 10);
+PJON_ASK bus_b(9, 10, 10);
+
+void setup() {
+  // Device 45 transmits on channel A, device 44 is on channel B
+  bus_a.add_route(44, 44, &bus_b);
+  bus_b.add_route(45, 45, &bus_a);
+};
+
+/* Buses are polled in turn: a frame starting while the other bus is
+   receiving is lost and retransmitted by the sender */
+
+void loop() {
+  bus_a.update();
+  bus_b.update();
+  bus_a.receive(1000);
+  bus_b.receive(1000);
+};
@@ -0,0 +1,15 @@
+#include <PJON_ASK.h>
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 45);
+
+void setup() {
+  // Device 44 is reachable through the router 10
+  network.add_route(44, 10);
+  // Send B to device 44 every second (see BlinkTest/Receiver)
+  network.send(44, "B", 1, 1000000);
+}
+
+void loop() {
+  network.update();
+};
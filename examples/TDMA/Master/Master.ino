@@ -0,0 +1,25 @@
+#include <PJON_ASK.h>
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 44);
+
+// Device id transmitting in each slot
+uint8_t slot_map[] = {44, 45, 46, 47};
+
+void setup() {
+  Serial.begin(115200);
+  network.set_receiver(receiver_function);
+  // Slots of 100 milliseconds, enough for a 10 bytes packet and its ACK
+  network.set_tdma_master(slot_map, 4, 100);
+};
+
+static void receiver_function(uint8_t length, uint8_t *payload) {
+  for(uint8_t i = 0; i < length; i++)
+    Serial.print((char)payload[i]);
+  Serial.println();
+}
+
+void loop() {
+  network.update();
+  network.receive(1000);
+};
@@ -0,0 +1,16 @@
+#include <PJON_ASK.h>
+
+// network(Arduino pin used, selected device id)
+PJON_ASK network(11, 12, 45);
+
+void setup() {
+  // Transmit only in the slot assigned by the master's beacon
+  network.set_tdma(true);
+  // Send HI to the master every second
+  network.send(44, "HI!", 3, 1000000);
+};
+
+void loop() {
+  network.update();
+  network.receive(1000);
+};